@@ -3,7 +3,13 @@
 #include<stdlib.h> //exit()
 #include<stdint.h>
 #include<stdbool.h>
+#include<string.h>
+#include<ctype.h>
 #include<time.h>
+#include<fcntl.h>       //open()
+#include<unistd.h>      //close()
+#include<sys/mman.h>    //mmap()
+#include<sys/stat.h>    //fstat()
 #ifdef DEBUG
 #define DEBUG_PRINT(...) printf(__VA_ARGS__)
 #else
@@ -16,6 +22,47 @@ typedef struct {
     SDL_Renderer *renderer;
 }sdl_t;//sdl stuff
 
+// run modes selected from the command line
+typedef enum{
+    MODE_PLAY,      // SDL window, keyboard input
+    MODE_CONFORM,   // headless, check engines against emulate_instruction()
+    MODE_BUILD_LIBRARY, // index roms into a library pack file
+    MODE_AUTOTUNE,  // headless, find the lowest clock per rom
+    MODE_FUZZ_INPUT,// headless, search keypad inputs that crash a rom
+}run_mode_t;
+
+//ROM library pack file: header, index entries sorted by hash, then the rom bodies
+#define ROM_LIBRARY_MAGIC   0x424C3843  //"C8LB"
+#define ROM_LIBRARY_VERSION 4
+#define DEFAULT_LIBRARY     "roms.pack" //Picked up by play mode when present
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rom_count;
+    uint32_t reserved;
+}rom_library_header_t;
+
+typedef struct{
+    uint64_t hash;                      //FNV-1a of the rom body
+    uint32_t offset;                    //Rom body offset in the pack
+    uint32_t size;                      //Rom size in bytes
+    uint32_t instructions_per_second;   //Recommended cpu clock
+    uint8_t hires;                      //64x64 hires rom (starts with 0x1260)
+    uint8_t tuned;                      //instructions_per_second comes from autotune
+    uint8_t reserved[2];
+    int64_t mtime;                      //Modification time of the file when indexed
+    char name[128];                     //Path the rom was indexed from
+    char notes[256];                    //Lines about keys from the sidecar .txt
+}rom_entry_t;
+
+//Opened (memory-mapped) library
+typedef struct{
+    const uint8_t* data;
+    size_t size;
+    const rom_library_header_t* header;
+    const rom_entry_t* entries;
+}rom_library_t;
+
 //sdl configuration object
 typedef struct {
     uint32_t foreground_color;
@@ -24,6 +71,25 @@ typedef struct {
     uint32_t window_height;// sdl window height
     uint32_t scale_factor; // scale original chip8 pixel e.g 20x
     uint32_t instructions_per_second;       // chip8 cpu clock hz
+    bool ips_set;                           // clock given with --ips, overrides rom profiles
+    run_mode_t mode;                        // play or a headless batch mode
+    uint32_t seed;                          // seed for headless sessions (keypad script, rand)
+    uint32_t instructions_per_session;      // headless: instructions run per rom
+    uint32_t check_interval;                // conform: compare engines every N instructions
+    uint32_t fuzz_streams;                  // conform: random opcode streams to check
+    uint32_t reference_ips;                 // autotune: clock of the reference run
+    uint32_t latency_frames;                // autotune: how late a frame may show, 0 for identical frames only
+    uint32_t settle_frames;                 // autotune: frames not compared at the start (with latency)
+    bool raise;                             // autotune: also save clocks above the rom's own
+    uint32_t sessions;                      // autotune: scripted keypad sessions that must agree
+    const char* input_path;                 // autotune: recorded keypad session used instead
+    const char* record_path;                // play: record the keypad of every frame here
+    uint32_t session_frames;                // autotune, fuzz-input: frames in a keypad session
+    uint32_t fuzz_seconds;                  // fuzz-input: time spent on each rom
+    int rom_count;
+    const char** roms;                      // rom paths given on the command line
+    const char* library_path;               // rom library pack file to use or build
+    rom_library_t* library;                 // opened library, NULL when not used
 
 }config_t;//all configuration attributes, easy for tracking
 
@@ -58,10 +124,13 @@ typedef struct {
     uint8_t delay_timer;        //Decrement at 60hz when>0
     uint8_t audio_timer;        //Decrement at 60hz and play music when>0
     bool keypad[16];        //Hex keypad 0x0-0xF
+    uint32_t rand_state;        //CXNN random state, kept per machine so sessions can be replayed
     const char *rom_name;       //Currently running rom
     intstruction_t inst;        //Currently executing instruction
 }chip8_t;
 
+#define ENTRY_POINT 0x200   //CHIP8 rom will be loaded to 0x200
+
 
 
 
@@ -103,8 +172,8 @@ bool init_sdl(sdl_t* sdl,const config_t* config){
     return true;//init success
 }
 
-bool init_chip8(chip8_t* chip8, const char rom_name[]){
-    const uint32_t entry_point = 0x200; //CHIP8 rom will be loaded to 0x200
+//Reset chip8 to power on state: font loaded, PC at the rom entry point
+void reset_chip8(chip8_t* chip8){
     const uint8_t font[] = {
 	0xF0, 0x90, 0x90, 0x90, 0xF0,		// 0    11110000
 	0x20, 0x60, 0x20, 0x20, 0x70,		// 1    1  10000
@@ -123,9 +192,21 @@ bool init_chip8(chip8_t* chip8, const char rom_name[]){
 	0xF0, 0x80, 0xF0, 0x80, 0xF0,		// E
 	0xF0, 0x80, 0xF0, 0x80, 0x80		// F
 };
+    const uint32_t rand_state = chip8->rand_state; //Keep the seed chosen by the caller
+    memset(chip8,0,sizeof(*chip8));
     // Load Font
     memcpy(&chip8->ram[0],font,sizeof(font)); //load font to the ram[0];
 
+    chip8->state = RUNNING;     //chip8 default on/running
+    chip8->PC = ENTRY_POINT;    //Program counter start at rom entry point
+    chip8->stack_ptr = &chip8->stack[0];
+    chip8->rand_state = rand_state ? rand_state : 1; //xorshift state must not be 0
+}
+
+bool init_chip8(chip8_t* chip8, const char rom_name[]){
+    const uint32_t entry_point = ENTRY_POINT; //CHIP8 rom will be loaded to 0x200
+    reset_chip8(chip8);
+
     // Open Rom file
     FILE* rom = fopen(rom_name, "rb");
     if(!rom){
@@ -149,13 +230,27 @@ bool init_chip8(chip8_t* chip8, const char rom_name[]){
     
     fclose(rom);//close rom
 
-    chip8->state = RUNNING;     //chip8 default on/running
-    chip8->PC = entry_point;    //Program counter start at rom entry point
     chip8->rom_name = rom_name;
-    chip8->stack_ptr = &chip8->stack[0]; 
     return true;            //init chip8 success
 }
 
+//Copy a whole machine. stack_ptr points into the machine itself,
+//so it has to be rebased onto the copy's stack.
+void fork_chip8(chip8_t* dst, const chip8_t* src){
+    *dst = *src;
+    dst->stack_ptr = &dst->stack[0] + (src->stack_ptr - &src->stack[0]);
+}
+
+//xorshift32, random source of CXNN
+uint32_t chip8_rand(chip8_t* chip8){
+    uint32_t x = chip8->rand_state;
+    x ^= x<<13;
+    x ^= x>>17;
+    x ^= x<<5;
+    chip8->rand_state = x;
+    return x;
+}
+
 
 bool set_config(config_t* config,const int argc,char** argv){
     
@@ -167,12 +262,78 @@ bool set_config(config_t* config,const int argc,char** argv){
         .background_color = 0X000000FF,//RGBA (black)
         .scale_factor = 20, //Default resolution will be 1280*640 
         .instructions_per_second = 700, // 1 second chip 8 fetch how much instructions
+        .mode = MODE_PLAY,
+        .seed = 1,
+        .instructions_per_session = 1000000, // headless sessions run ~24 minutes of chip8 time
+        .check_interval = 100,
+        .fuzz_streams = 0,
+        .reference_ips = 6000,
+        .latency_frames = 0,
+        .settle_frames = 0,
+        .sessions = 4,
+        .session_frames = 1200, // 20 seconds
+        .fuzz_seconds = 10,
     };
+    config->roms = calloc(argc, sizeof(char*));
+    if(config->roms == NULL) return false;
 
     //override default config
     for(int i=1;i<argc;i++){
-        (void)argv[i];//prevent compile error
+        //Options that take a number
+        uint32_t* value = NULL;
+        if(strcmp(argv[i],"--ips")==0)              value = &config->instructions_per_second;
+        else if(strcmp(argv[i],"--seed")==0)        value = &config->seed;
+        else if(strcmp(argv[i],"--instructions")==0)value = &config->instructions_per_session;
+        else if(strcmp(argv[i],"--interval")==0)    value = &config->check_interval;
+        else if(strcmp(argv[i],"--fuzz")==0)        value = &config->fuzz_streams;
+        else if(strcmp(argv[i],"--reference-ips")==0)value = &config->reference_ips;
+        else if(strcmp(argv[i],"--latency")==0)     value = &config->latency_frames;
+        else if(strcmp(argv[i],"--settle")==0)      value = &config->settle_frames;
+        else if(strcmp(argv[i],"--sessions")==0)    value = &config->sessions;
+        else if(strcmp(argv[i],"--frames")==0)      value = &config->session_frames;
+        else if(strcmp(argv[i],"--seconds")==0)     value = &config->fuzz_seconds;
+        config->ips_set |= value == &config->instructions_per_second;
+
+        if(value != NULL){
+            if(i+1 >= argc){
+                fprintf(stderr,"Missing value for %s\n",argv[i]);
+                return false;
+            }
+            *value = strtoul(argv[++i],NULL,0);
+        }else if(strcmp(argv[i],"--library")==0 || strcmp(argv[i],"--build-library")==0
+              || strcmp(argv[i],"--input")==0 || strcmp(argv[i],"--record")==0){
+            //Options that take a path
+            if(i+1 >= argc){
+                fprintf(stderr,"Missing value for %s\n",argv[i]);
+                return false;
+            }
+            if(strcmp(argv[i],"--build-library")==0) config->mode = MODE_BUILD_LIBRARY;
+            const char** path = strcmp(argv[i],"--input")==0 ? &config->input_path
+                              : strcmp(argv[i],"--record")==0 ? &config->record_path : &config->library_path;
+            *path = argv[++i];
+        }else if(strcmp(argv[i],"--conform")==0){
+            config->mode = MODE_CONFORM;
+        }else if(strcmp(argv[i],"--autotune")==0){
+            config->mode = MODE_AUTOTUNE;
+        }else if(strcmp(argv[i],"--raise")==0){
+            config->raise = true;
+        }else if(strcmp(argv[i],"--fuzz-input")==0){
+            config->mode = MODE_FUZZ_INPUT;
+        }else if(strncmp(argv[i],"--",2)==0){
+            fprintf(stderr,"Unknown option %s\n",argv[i]);
+            return false;
+        }else{
+            config->roms[config->rom_count++] = argv[i];
+        }
     }
+    //Run at least one instruction per frame, and compare at least every instruction
+    if(config->instructions_per_second < 60) config->instructions_per_second = 60;
+    if(config->check_interval == 0) config->check_interval = 1;
+    //Autotune ladder is whole instructions per frame
+    config->reference_ips -= config->reference_ips % 60;
+    if(config->reference_ips < 60) config->reference_ips = 60;
+    if(config->session_frames == 0) config->session_frames = 1;
+    if(config->sessions == 0) config->sessions = 1;
     return true;//set_config success.
 }
 void final__cleanup(const sdl_t sdl){
@@ -501,7 +662,7 @@ void emulate_instruction(chip8_t* chip8, config_t* config){
             // CXNN Sets VX to the result of a bitwise and operation on a random number (Typically: 0 to 255) and NN.
             DEBUG_PRINT("Set V[%X](%02X) to a (rand() %% 256) & NN(%X)\n",
             chip8->inst.X,chip8->V[chip8->inst.X],chip8->inst.NN);
-            chip8->V[chip8->inst.X] = (rand() % 256) & chip8->inst.NN;
+            chip8->V[chip8->inst.X] = (chip8_rand(chip8) % 256) & chip8->inst.NN;
             break;    
         case 0X0D:
             // DXYN: Draw a sprite which stored at I to I+7 (8bits), to (x,y) on display
@@ -663,16 +824,1551 @@ void update_chip8_timer(chip8_t* chip8){
         chip8->audio_timer --;
         
 };
+
+//================ Headless sessions ================
+//A session is main()'s loop without SDL: every instructions_per_second/60
+//instructions make one frame, which gets a scripted keypad and a timer tick.
+
+//Execute one instruction on a machine (emulate_instruction() or a faster core)
+typedef void (*engine_fn)(chip8_t* chip8, config_t* config);
+
+//Mix 32 bits, derive keypad scripts and fuzz streams from a seed
+uint32_t hash32(uint32_t x){
+    x ^= x>>16;
+    x *= 0x7FEB352D;
+    x ^= x>>15;
+    x *= 0x846CA68B;
+    x ^= x>>16;
+    return x;
+}
+
+//FNV-1a 64bits hash
+uint64_t hash_bytes(const void* data, size_t size){
+    const uint8_t* bytes = data;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for(size_t i=0;i<size;i++){
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+//Scripted keypad of a frame: half of the time one key is held, 8 frames at a time
+uint16_t session_keys(uint32_t seed, uint64_t frame){
+    const uint32_t h = hash32(seed ^ hash32((uint32_t)(frame/8)));
+    return (h & 0x10) ? (uint16_t)(1u << (h & 0xF)) : 0;
+}
+
+//Bit i of keys is key 0xi
+void set_keypad(chip8_t* chip8, uint16_t keys){
+    for(uint8_t i=0;i<sizeof(chip8->keypad);i++)
+        chip8->keypad[i] = (keys>>i) & 1;
+}
+
+//Keys held, the other way around
+uint16_t keypad_mask(const chip8_t* chip8){
+    uint16_t keys = 0;
+    for(uint8_t i=0;i<sizeof(chip8->keypad);i++)
+        keys |= (uint16_t)chip8->keypad[i] << i;
+    return keys;
+}
+
+//Run instruction number `count` of a session.
+//The first instruction of a frame ticks the timers (end of last frame) and feeds the keypad.
+void session_step(chip8_t* chip8, config_t* config, engine_fn step, uint64_t count){
+    const uint32_t per_frame = config->instructions_per_second / 60;
+    if(count % per_frame == 0){
+        if(count>0) update_chip8_timer(chip8);
+        set_keypad(chip8, session_keys(config->seed, count / per_frame));
+    }
+    step(chip8, config);
+}
+
+//Out of range accesses emulate_instruction() would do on the next instruction
+typedef enum{
+    FAULT_NONE,
+    FAULT_PC,               //Fetch past the end of ram
+    FAULT_STACK_OVERFLOW,   //2NNN with a full stack
+    FAULT_STACK_UNDERFLOW,  //00EE with an empty stack
+    FAULT_RAM,              //DXYN/FX33/FX55/FX65 past the end of ram
+    FAULT_KEYPAD,           //EX9E/EXA1 with VX > 0xF
+}fault_t;
+
+const char* fault_names[] = {
+    [FAULT_NONE] = "none",
+    [FAULT_PC] = "PC out of ram",
+    [FAULT_STACK_OVERFLOW] = "stack overflow",
+    [FAULT_STACK_UNDERFLOW] = "stack underflow",
+    [FAULT_RAM] = "ram access out of range",
+    [FAULT_KEYPAD] = "keypad index out of range",
+};
+
+//Check the next instruction before running it (decode the same way as emulate_instruction())
+fault_t check_instruction(const chip8_t* chip8, const config_t* config){
+    const size_t ram_size = sizeof(chip8->ram);
+    if(chip8->PC + 1u >= ram_size) return FAULT_PC;
+
+    const uint16_t opcode = (chip8->ram[chip8->PC])<<8 | chip8->ram[chip8->PC+1];
+    const uint8_t X = (opcode>>8) & 0X000F;
+    const uint8_t NN = opcode & 0X00FF;
+    const size_t stack_depth = chip8->stack_ptr - &chip8->stack[0];
+
+    switch((opcode>>12) & 0X000F){
+        case 0x00:
+            if(NN == 0XEE && stack_depth == 0) return FAULT_STACK_UNDERFLOW;
+            break;
+        case 0x02:
+            if(stack_depth >= sizeof(chip8->stack)/sizeof(chip8->stack[0])) return FAULT_STACK_OVERFLOW;
+            break;
+        case 0x0D:{
+            //Rows under the bottom edge are clipped and never read
+            const uint32_t y = chip8->V[(opcode>>4) & 0X000F] % config->window_height;
+            uint32_t rows = opcode & 0X000F;
+            if(rows > config->window_height - y) rows = config->window_height - y;
+            if(chip8->I + rows > ram_size) return FAULT_RAM;
+            break;
+        }
+        case 0x0E:
+            if((NN == 0x9E || NN == 0xA1) && chip8->V[X] >= sizeof(chip8->keypad)) return FAULT_KEYPAD;
+            break;
+        case 0x0F:
+            if(NN == 0x33 && chip8->I + 3u > ram_size) return FAULT_RAM;
+            if((NN == 0x55 || NN == 0x65) && chip8->I + X + 1u > ram_size) return FAULT_RAM;
+            break;
+        default:
+            break;
+    }
+    return FAULT_NONE;
+}
+
+//Run run(0 .. job_count-1, data) on all cores, the calling thread works too
+typedef void (*job_fn)(int job, void* data);
+
+typedef struct{
+    job_fn run;
+    void* data;
+    int job_count;
+    SDL_atomic_t next_job;
+}job_pool_t;
+
+int job_worker(void* data){
+    job_pool_t* pool = data;
+    for(int i = SDL_AtomicAdd(&pool->next_job,1); i < pool->job_count; i = SDL_AtomicAdd(&pool->next_job,1))
+        pool->run(i, pool->data);
+    return 0;
+}
+
+//Return the number of threads used
+int run_jobs(job_fn run, void* data, int job_count){
+    job_pool_t pool = {.run = run, .data = data, .job_count = job_count};
+    //Workers pull jobs until the list is empty
+    SDL_Thread* threads[64];
+    int thread_count = SDL_GetCPUCount() - 1;
+    if(thread_count > job_count - 1) thread_count = job_count - 1;
+    if(thread_count > (int)(sizeof(threads)/sizeof(threads[0]))) thread_count = sizeof(threads)/sizeof(threads[0]);
+    if(thread_count < 0) thread_count = 0;
+
+    for(int t=0;t<thread_count;t++){
+        threads[t] = SDL_CreateThread(job_worker, "chip8 job", &pool);
+        if(threads[t] == NULL){
+            thread_count = t; //Run with the threads we got
+            break;
+        }
+    }
+    job_worker(&pool);
+    for(int t=0;t<thread_count;t++) SDL_WaitThread(threads[t], NULL);
+    return thread_count + 1;
+}
+
+//================ ROM library ================
+//One pack file holds an index of every rom, keyed by content hash, followed by the rom bodies.
+//It is memory-mapped once, so loading a rom from it is a memcpy instead of fopen/fread.
+
+//Read a whole rom file, return its size or 0 on failure
+size_t read_rom_file(const char* path, uint8_t* buffer, size_t max_size){
+    FILE* rom = fopen(path, "rb");
+    if(!rom){
+        SDL_Log("Rom file %s can't not found or doesn't exist\n", path);
+        return 0;
+    }
+    fseek(rom,0,SEEK_END);
+    const long rom_size = ftell(rom);
+    rewind(rom);
+    size_t read = 0;
+    if(rom_size <= 0 || (size_t)rom_size > max_size){
+        SDL_Log("ROM file %s is empty or too large! Rom size: %ld , MAX size allowed: %zu\n",
+                path,rom_size,max_size);
+    }else if(fread(buffer, rom_size, 1, rom) != 1){
+        SDL_Log("Could not read rom:%s\n",path);
+    }else{
+        read = rom_size;
+    }
+    fclose(rom);
+    return read;
+}
+
+//Case insensitive strstr, for picking lines out of the notes
+bool contains_ci(const char* text, const char* word){
+    for(; *text; text++){
+        size_t i = 0;
+        while(word[i] && text[i] && tolower((unsigned char)text[i]) == word[i]) i++;
+        if(word[i] == '\0') return true;
+    }
+    return false;
+}
+
+//Collect the lines of the rom's sidecar .txt that talk about keys: "line | line | ..."
+void read_rom_notes(const char* rom_path, char* notes, size_t size){
+    notes[0] = '\0';
+    char txt_path[512];
+    const char* extension = strrchr(rom_path, '.');
+    const int base_length = extension ? (int)(extension - rom_path) : (int)strlen(rom_path);
+    if(snprintf(txt_path, sizeof(txt_path), "%.*s.txt", base_length, rom_path) >= (int)sizeof(txt_path)) return;
+
+    FILE* txt = fopen(txt_path, "r");
+    if(!txt) return; //Most roms have no notes
+
+    char line[512];
+    size_t length = 0;
+    while(fgets(line, sizeof(line), txt)){
+        if(!contains_ci(line, "key") && !contains_ci(line, "press")) continue;
+        //Trim spaces and line ending
+        char* start = line;
+        while(isspace((unsigned char)*start)) start++;
+        size_t end = strlen(start);
+        while(end > 0 && isspace((unsigned char)start[end-1])) start[--end] = '\0';
+        if(end == 0) continue;
+
+        const int written = snprintf(notes + length, size - length, "%s%s", length ? " | " : "", start);
+        if(written < 0 || (size_t)written >= size - length) break; //Notes full, keep what fits
+        length += written;
+    }
+    fclose(txt);
+}
+
+void close_rom_library(rom_library_t* library){
+    if(library->data != NULL) munmap((void*)library->data, library->size);
+    *library = (rom_library_t){0};
+}
+
+//Map a pack file and check its index
+bool open_rom_library(rom_library_t* library, const char* path){
+    *library = (rom_library_t){0};
+    const int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        SDL_Log("Rom library %s can't not found or doesn't exist\n", path);
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(rom_library_header_t)){
+        SDL_Log("Rom library %s is not a library\n", path);
+        close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); //The mapping keeps the file
+    if(data == MAP_FAILED){
+        SDL_Log("Could not map rom library %s\n", path);
+        return false;
+    }
+    library->data = data;
+    library->size = st.st_size;
+    library->header = data;
+    library->entries = (const rom_entry_t*)(library->header + 1);
+
+    bool ok = library->header->magic == ROM_LIBRARY_MAGIC
+           && library->header->version == ROM_LIBRARY_VERSION
+           && library->header->rom_count <= (library->size - sizeof(rom_library_header_t)) / sizeof(rom_entry_t);
+    for(uint32_t i=0;ok && i<library->header->rom_count;i++){
+        const rom_entry_t* entry = &library->entries[i];
+        ok = entry->size <= 4096 - ENTRY_POINT
+          && entry->offset <= library->size && entry->size <= library->size - entry->offset
+          && memchr(entry->name, '\0', sizeof(entry->name)) != NULL
+          && memchr(entry->notes, '\0', sizeof(entry->notes)) != NULL;
+    }
+    if(!ok){
+        SDL_Log("Rom library %s is corrupted or from another version, rebuild it\n", path);
+        close_rom_library(library);
+        return false;
+    }
+    return true;
+}
+
+const rom_entry_t* find_rom_by_hash(const rom_library_t* library, uint64_t hash){
+    uint32_t low = 0, high = library->header->rom_count;
+    while(low < high){
+        const uint32_t mid = low + (high - low) / 2;
+        if(library->entries[mid].hash < hash) low = mid + 1;
+        else high = mid;
+    }
+    return (low < library->header->rom_count && library->entries[low].hash == hash) ? &library->entries[low] : NULL;
+}
+
+//Write a pack next to the target and rename it over, a crash never leaves half a library
+//and sessions that have the old pack mapped keep reading the old file
+bool write_rom_library(const char* path, const rom_library_header_t* header, const rom_entry_t* entries,
+                       const uint8_t* bodies, uint32_t body_size){
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* pack = fopen(tmp_path, "wb");
+    bool ok = pack != NULL;
+    if(ok){
+        ok = fwrite(header, sizeof(*header), 1, pack) == 1
+          && fwrite(entries, sizeof(rom_entry_t), header->rom_count, pack) == header->rom_count
+          && fwrite(bodies, 1, body_size, pack) == body_size;
+        ok = (fclose(pack) == 0) && ok;
+        ok = ok && rename(tmp_path, path) == 0;
+    }
+    if(!ok){
+        SDL_Log("Could not write rom library %s\n", path);
+        remove(tmp_path);
+    }
+    return ok;
+}
+
+int compare_rom_entries(const void* a, const void* b){
+    const uint64_t hash_a = ((const rom_entry_t*)a)->hash;
+    const uint64_t hash_b = ((const rom_entry_t*)b)->hash;
+    return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+//Index every rom given on the command line into one pack file.
+//Roms with the same content are stored once, under the first path.
+bool build_rom_library(const config_t* config){
+    const size_t max_rom_size = 4096 - ENTRY_POINT;
+    rom_entry_t* entries = calloc(config->rom_count ? config->rom_count : 1, sizeof(rom_entry_t));
+    uint8_t* bodies = malloc((config->rom_count ? config->rom_count : 1) * max_rom_size);
+    if(entries == NULL || bodies == NULL){
+        free(entries);
+        free(bodies);
+        return false;
+    }
+
+    //Tuned speed profiles of an existing library survive the rebuild
+    rom_library_t old_library = {0};
+    struct stat st;
+    if(stat(config->library_path, &st) == 0) open_rom_library(&old_library, config->library_path);
+
+    uint32_t rom_count = 0, body_size = 0;
+    for(int i=0;i<config->rom_count;i++){
+        const char* path = config->roms[i];
+        const size_t size = read_rom_file(path, bodies + body_size, max_rom_size);
+        if(size == 0) continue;
+        const uint64_t hash = hash_bytes(bodies + body_size, size);
+
+        bool duplicate = false;
+        for(uint32_t j=0;j<rom_count && !duplicate;j++) duplicate = entries[j].hash == hash;
+        if(duplicate) continue;
+        if(strlen(path) >= sizeof(entries[0].name)){
+            SDL_Log("Rom path %s is too long for the library, skipped\n", path);
+            continue;
+        }
+
+        rom_entry_t* entry = &entries[rom_count++];
+        entry->hash = hash;
+        entry->offset = body_size; //Relative to the bodies, fixed up below
+        entry->size = size;
+        //Hires roms start by jumping over the 64x64 mode setup: 0x1260
+        entry->hires = size >= 2 && bodies[body_size] == 0x12 && bodies[body_size+1] == 0x60;
+        entry->instructions_per_second = config->instructions_per_second;
+        const rom_entry_t* old_entry = old_library.data ? find_rom_by_hash(&old_library, hash) : NULL;
+        if(old_entry != NULL && old_entry->tuned){
+            entry->instructions_per_second = old_entry->instructions_per_second;
+            entry->tuned = true;
+        }
+        //Size and mtime tell find_rom() whether the file at this path still is this rom
+        entry->mtime = stat(path, &st) == 0 ? (int64_t)st.st_mtime : 0;
+        strcpy(entry->name, path);
+        read_rom_notes(path, entry->notes, sizeof(entry->notes));
+        body_size += size;
+    }
+    close_rom_library(&old_library);
+
+    //Sorted by hash so lookups are a binary search
+    qsort(entries, rom_count, sizeof(rom_entry_t), compare_rom_entries);
+    const rom_library_header_t header = {
+        .magic = ROM_LIBRARY_MAGIC,
+        .version = ROM_LIBRARY_VERSION,
+        .rom_count = rom_count,
+    };
+    const uint32_t bodies_offset = sizeof(header) + rom_count * sizeof(rom_entry_t);
+    for(uint32_t i=0;i<rom_count;i++) entries[i].offset += bodies_offset;
+
+    const bool ok = write_rom_library(config->library_path, &header, entries, bodies, body_size);
+    if(ok) printf("Indexed %u roms (%d given) into %s\n", rom_count, config->rom_count, config->library_path);
+    free(entries);
+    free(bodies);
+    return ok;
+}
+
+//Look a rom path up: by the indexed name first, as long as the file's size and mtime still match,
+//by content hash if the file was renamed, edited since indexing or is a duplicate
+const rom_entry_t* find_rom(const rom_library_t* library, const char* path){
+    struct stat st;
+    if(stat(path, &st) == 0){
+        for(uint32_t i=0;i<library->header->rom_count;i++){
+            const rom_entry_t* entry = &library->entries[i];
+            if(strcmp(entry->name, path) == 0 && (int64_t)st.st_size == entry->size
+               && (int64_t)st.st_mtime == entry->mtime) return entry;
+        }
+    }
+
+    uint8_t rom[4096 - ENTRY_POINT];
+    const size_t size = read_rom_file(path, rom, sizeof(rom));
+    return size ? find_rom_by_hash(library, hash_bytes(rom, size)) : NULL;
+}
+
+//init_chip8() from the mapped pack, no file access
+void init_chip8_from_library(chip8_t* chip8, const rom_library_t* library, const rom_entry_t* entry){
+    reset_chip8(chip8);
+    memcpy(&chip8->ram[ENTRY_POINT], library->data + entry->offset, entry->size);
+    chip8->rom_name = entry->name;
+}
+
+//Roms a headless mode works on: the roms on the command line, or the whole library when none are given
+int batch_rom_count(const config_t* config){
+    if(config->library != NULL && config->rom_count == 0) return config->library->header->rom_count;
+    return config->rom_count;
+}
+
+//Name of batch rom i, and its library entry (NULL when it has to be read from the file)
+void batch_rom(const config_t* config, int i, const char** name, const rom_entry_t** entry){
+    if(config->library != NULL && config->rom_count == 0){
+        *entry = &config->library->entries[i];
+        *name = (*entry)->name;
+        return;
+    }
+    *name = config->roms[i];
+    *entry = config->library ? find_rom(config->library, *name) : NULL;
+}
+
+bool load_batch_rom(chip8_t* chip8, const config_t* config, const char* name, const rom_entry_t* entry){
+    if(entry == NULL) return init_chip8(chip8, name);
+    init_chip8_from_library(chip8, config->library, entry);
+    return true;
+}
+
+//================ Conformance harness ================
+//Runs the same deterministic session on emulate_instruction() and on every engine,
+//compares register file, framebuffer and ram every check_interval instructions,
+//then replays the failing interval one instruction at a time to find where they split.
+
+typedef struct{
+    const char* name;
+    engine_fn step;
+}engine_t;
+
+//Engines checked against the reference. Every faster core has to be listed here.
+//"replay" is the reference itself: it catches hidden state that breaks reproducible sessions.
+const engine_t engines[] = {
+    {"replay", emulate_instruction},
+};
+
+//Known-bad engine for the harness self-check: 8XY4 forgets the carry flag
+void mutant_instruction(chip8_t* chip8, config_t* config){
+    const uint16_t opcode = chip8->ram[chip8->PC]<<8 | chip8->ram[chip8->PC+1];
+    const uint8_t VF = chip8->V[0xF];
+    emulate_instruction(chip8, config);
+    if((opcode & 0xF00F) == 0x8004 && ((opcode >> 8) & 0xF) != 0xF) chip8->V[0xF] = VF;
+}
+
+//V0 = 0xF0, V1 = 1, then V0 += V1 and V2 |= VF forever: the 16th add carries, and V2 keeps
+//the lost carry visible at every checkpoint. Instruction 0 and 1 are the loads, each loop is
+//3 instructions, so the mutant must be caught at instruction 2 + 15*3 = 47.
+const uint8_t self_check_program[] = {0x60,0xF0, 0x61,0x01, 0x80,0x14, 0x82,0xF1, 0x12,0x04};
+const engine_t self_check_engine = {"mutant", mutant_instruction};
+#define SELF_CHECK_INSTRUCTION 47
+#define SELF_CHECK_PC          0x204
+#define SELF_CHECK_OPCODE      0x8014
+
+//One rom, or one random opcode stream, against one engine
+typedef struct{
+    const char* rom_name;       //NULL for a fuzz stream
+    const rom_entry_t* entry;   //Rom in the library, NULL to read rom_name
+    const uint8_t* program;     //Built-in program instead of a rom or fuzz stream
+    size_t program_size;
+    uint32_t stream;            //Fuzz stream number
+    const engine_t* engine;
+    bool loaded;
+    bool diverged;
+    bool pinpointed;            //Divergence reproduced instruction by instruction
+    uint64_t executed;          //Instructions run on each side
+    uint64_t diverged_at;       //First instruction whose result differs
+    uint16_t diverged_pc;
+    uint16_t diverged_opcode;
+    fault_t fault;              //Fault both sides hit, ends the session
+    uint64_t display_hash;      //Framebuffer at the end of the session
+    config_t* config;
+}conform_job_t;
+
+//Register file, framebuffer and ram. Both machines are in memory, so the
+//framebuffer is compared directly rather than through hash_bytes().
+bool same_state(const chip8_t* a, const chip8_t* b){
+    const size_t depth_a = a->stack_ptr - &a->stack[0];
+    const size_t depth_b = b->stack_ptr - &b->stack[0];
+    return a->PC == b->PC
+        && a->I == b->I
+        && memcmp(a->V,b->V,sizeof(a->V)) == 0
+        && a->delay_timer == b->delay_timer
+        && a->audio_timer == b->audio_timer
+        && depth_a == depth_b
+        && memcmp(a->stack,b->stack,depth_a*sizeof(a->stack[0])) == 0
+        && memcmp(a->display,b->display,sizeof(a->display)) == 0
+        && memcmp(a->ram,b->ram,sizeof(a->ram)) == 0;
+}
+
+bool load_conform_job(chip8_t* chip8, const conform_job_t* job, const config_t* config){
+    chip8->rand_state = hash32(config->seed ^ job->stream);
+    if(job->rom_name != NULL) return load_batch_rom(chip8, config, job->rom_name, job->entry);
+    if(job->program != NULL){
+        reset_chip8(chip8);
+        memcpy(&chip8->ram[ENTRY_POINT], job->program, job->program_size);
+        return true;
+    }
+
+    //Fuzz stream: the whole program space is random opcodes
+    reset_chip8(chip8);
+    uint32_t x = hash32(config->seed + job->stream);
+    for(size_t i=ENTRY_POINT;i<sizeof(chip8->ram);i++){
+        x = hash32(x + (uint32_t)i);
+        chip8->ram[i] = (uint8_t)x;
+    }
+    return true;
+}
+
+//Step the reference and an engine side by side until instruction `end` or a fault.
+//With stop_on_diff, stop right after the first instruction whose result differs.
+//Return false if they disagree on state or on the fault they hit.
+bool run_lockstep(chip8_t* ref, chip8_t* fast, const engine_t* engine, config_t* config,
+                  uint64_t* count, uint64_t end, bool stop_on_diff, fault_t* fault){
+    while(*count < end){
+        *fault = check_instruction(ref, config);
+        if(*fault != check_instruction(fast, config)) return false;
+        if(*fault != FAULT_NONE) break;
+
+        session_step(ref, config, emulate_instruction, *count);
+        session_step(fast, config, engine->step, *count);
+        (*count)++;
+        if(stop_on_diff && !same_state(ref, fast)) return false;
+    }
+    return same_state(ref, fast);
+}
+
+void run_conform_job(int i, void* data){
+    conform_job_t* job = &((conform_job_t*)data)[i];
+    config_t* config = job->config;
+    chip8_t ref, fast, ref_mark, fast_mark;
+    if(!load_conform_job(&ref, job, config)) return;
+    job->loaded = true;
+    fork_chip8(&fast, &ref);
+    fork_chip8(&ref_mark, &ref);
+    fork_chip8(&fast_mark, &ref);
+
+    uint64_t count = 0, mark = 0;   //mark: last checkpoint where both sides agreed
+    fault_t fault = FAULT_NONE;
+    while(count < config->instructions_per_session && fault == FAULT_NONE){
+        const uint64_t left = config->instructions_per_session - count;
+        const uint64_t end = count + (left > config->check_interval ? config->check_interval : left);
+
+        if(!run_lockstep(&ref, &fast, job->engine, config, &count, end, false, &fault)){
+            //Go back to the checkpoint and compare after every instruction
+            job->diverged = true;
+            job->diverged_at = mark;
+            fork_chip8(&ref, &ref_mark);
+            fork_chip8(&fast, &fast_mark);
+            count = mark;
+            while(count < end){
+                const uint64_t at = count;
+                const uint16_t pc = ref.PC;
+                const uint16_t opcode = (pc + 1u < sizeof(ref.ram)) ? (ref.ram[pc]<<8 | ref.ram[pc+1]) : 0;
+                if(!run_lockstep(&ref, &fast, job->engine, config, &count, count+1, true, &fault)){
+                    job->pinpointed = true;
+                    job->diverged_at = at;
+                    job->diverged_pc = pc;
+                    job->diverged_opcode = opcode;
+                    break;
+                }
+                if(fault != FAULT_NONE) break;
+            }
+            job->executed = count;
+            return;
+        }
+        fork_chip8(&ref_mark, &ref);
+        fork_chip8(&fast_mark, &fast);
+        mark = count;
+    }
+    job->executed = count;
+    job->fault = fault;
+    job->display_hash = hash_bytes(ref.display, sizeof(ref.display));
+}
+
+//Run the known-bad engine through the harness: it has to fail, at the exact instruction.
+//Keeps a broken harness from passing every engine silently.
+bool conform_self_check(const config_t* config){
+    //Same interval as the real run, but always long enough to reach the bug
+    config_t check_config = *config;
+    check_config.instructions_per_session = 1000;
+    conform_job_t job = {
+        .program = self_check_program,
+        .program_size = sizeof(self_check_program),
+        .engine = &self_check_engine,
+        .config = &check_config,
+    };
+    run_conform_job(0, &job);
+    const bool caught = job.diverged && job.pinpointed && job.diverged_at == SELF_CHECK_INSTRUCTION
+                     && job.diverged_pc == SELF_CHECK_PC && job.diverged_opcode == SELF_CHECK_OPCODE;
+    if(caught)
+        printf("ok    self-check: %s engine caught at instruction %d, PC 0x%04X, opcode 0x%04X\n",
+               self_check_engine.name, SELF_CHECK_INSTRUCTION, SELF_CHECK_PC, SELF_CHECK_OPCODE);
+    else
+        printf("FAIL  self-check: %s engine %s, expected instruction %d, PC 0x%04X, opcode 0x%04X\n",
+               self_check_engine.name, job.diverged ? "caught at the wrong place" : "not caught",
+               SELF_CHECK_INSTRUCTION, SELF_CHECK_PC, SELF_CHECK_OPCODE);
+    if(job.diverged && !caught)
+        printf("      got instruction %llu, PC 0x%04X, opcode 0x%04X%s\n", (unsigned long long)job.diverged_at,
+               job.diverged_pc, job.diverged_opcode, job.pinpointed ? "" : " (not pinpointed)");
+    return caught;
+}
+
+//Check every rom and fuzz stream on every engine, on all cores.
+//Return true if no engine diverges from the reference.
+bool run_conformance(config_t* config){
+    if(!conform_self_check(config)) return false;
+    const int engine_count = sizeof(engines)/sizeof(engines[0]);
+    const int rom_count = batch_rom_count(config);
+    const int session_count = rom_count + (int)config->fuzz_streams;
+    if(session_count == 0){
+        fprintf(stderr,"Nothing to check, give roms and/or --fuzz <streams>\n");
+        return false;
+    }
+
+    const int job_count = session_count * engine_count;
+    conform_job_t* jobs = calloc(job_count, sizeof(conform_job_t));
+    if(jobs == NULL) return false;
+    for(int i=0;i<job_count;i++){
+        const int session = i / engine_count;
+        conform_job_t* job = &jobs[i];
+        job->config = config;
+        job->engine = &engines[i % engine_count];
+        if(session >= rom_count){
+            job->stream = session - rom_count;
+        }else if(i % engine_count){
+            //Resolve once per rom, not once per engine
+            job->rom_name = jobs[i-1].rom_name;
+            job->entry = jobs[i-1].entry;
+        }else{
+            batch_rom(config, session, &job->rom_name, &job->entry);
+        }
+    }
+
+    const uint64_t start_counts = SDL_GetPerformanceCounter();
+    const int thread_count = run_jobs(run_conform_job, jobs, job_count);
+    const double seconds = (double)(SDL_GetPerformanceCounter() - start_counts) / SDL_GetPerformanceFrequency();
+
+    //Report
+    uint64_t executed = 0;
+    int failed = 0, faulted = 0;
+    for(int i=0;i<job_count;i++){
+        const conform_job_t* job = &jobs[i];
+        char name[32];
+        const char* session = job->rom_name;
+        if(session == NULL){
+            snprintf(name, sizeof(name), "fuzz stream %u", job->stream);
+            session = name;
+        }
+        executed += job->executed * 2; //Reference and engine
+
+        if(!job->loaded){
+            printf("FAIL  %-8s %s: could not load\n", job->engine->name, session);
+            failed++;
+        }else if(job->diverged){
+            if(job->pinpointed)
+                printf("FAIL  %-8s %s: diverged at instruction %llu, PC 0x%04X, opcode 0x%04X\n",
+                       job->engine->name, session, (unsigned long long)job->diverged_at,
+                       job->diverged_pc, job->diverged_opcode);
+            else
+                printf("FAIL  %-8s %s: diverged after instruction %llu, not reproducible on replay\n",
+                       job->engine->name, session, (unsigned long long)job->diverged_at);
+            failed++;
+        }else if(job->rom_name != NULL){
+            //Fuzz streams fault all the time, only roms are listed
+            printf("ok    %-8s %s: %llu instructions, display %016llX%s%s\n", job->engine->name, session,
+                   (unsigned long long)job->executed, (unsigned long long)job->display_hash,
+                   job->fault != FAULT_NONE ? ", both hit " : "",
+                   job->fault != FAULT_NONE ? fault_names[job->fault] : "");
+        }
+        if(job->fault != FAULT_NONE) faulted++;
+    }
+    printf("%d sessions x %d engines, %d failed, %d ended on a fault, %.1f M instructions/s on %d threads\n",
+           session_count, engine_count, failed, faulted,
+           seconds > 0 ? executed / seconds / 1e6 : 0.0, thread_count);
+
+    free(jobs);
+    return failed == 0;
+}
+
+//================ Clock autotune ================
+//Per rom and keypad session: record the frames at reference_ips, then binary search the
+//lowest clock (a multiple of 60, whole instructions per frame) up to the rom's current clock
+//whose frames are identical. With --latency, a clock whose frames show at most latency_frames
+//late (after the first settle_frames) is accepted when no clock is identical, but it must still
+//fit the busiest frame of the session. Profiles are saved into the library and applied by main()
+//at startup.
+//Roms that wait on the timers at the reference (most frames finish their work and spin) but
+//finish under half as many at their own clock are starved: the lowest clock that finishes nearly
+//as many frames as the reference is reported, and saved with --raise.
+//Roms that don't finish most frames even at the reference, or only keep up next to it, are paced
+//by the cpu, not the timers (the game speed follows the clock): their clock is left alone.
+//The sessions are a recording (--input) or `sessions` scripted ones. A session only counts if it
+//gets past the startup path: it runs code a session without keys never reaches (roms that never
+//read the keypad always count). A profile is only saved when every session that counts agrees.
+
+#define CPU_PACED_RUNGS 3   //A match this close to the reference clock is cpu pacing too
+#define FINISHED_FRAMES_PERCENT 50 //Under this share of frames finished at the reference, cpu pacing
+#define STARVED_PERCENT 50  //Under this share of the reference's finished frames, the rom's clock is starved
+#define KEEP_UP_PERCENT 90  //A clock keeps up if it finishes this share of the frames the reference does
+
+//Frames recorded at one clock
+typedef struct{
+    uint64_t* hashes;           //Framebuffer after every frame, 0 from a fault on
+    uint8_t* finished;          //The frame ended spinning: its work, and its picture, is done
+    uint32_t finished_frames;
+    uint64_t executed;
+    uint64_t spin_instructions; //Instructions run in idle loops
+    uint32_t busiest_frame;     //Most instructions a frame ran before it started spinning
+    uint8_t reached[4096/8];    //Bit per PC that ran
+    bool reads_keys;            //Ran EX9E, EXA1 or FX0A
+    fault_t fault;
+}frame_record_t;
+
+//What one session says about the rom's clock
+typedef enum{
+    SESSION_KEEPS,              //Nothing better than the rom's own clock
+    SESSION_LOWERS,             //A clock under the rom's own matches the reference
+    SESSION_NEEDS_MORE,         //Starved at the rom's own clock
+    SESSION_CPU_PACED,
+}session_verdict_t;
+
+typedef struct{
+    session_verdict_t verdict;
+    uint32_t ips;               //Lowered or needed clock
+    uint32_t latency;           //Frames the lowered clock may lag, 0 when identical
+    uint32_t finished_frames;   //Frames finished at the rom's own clock (needs more)
+    uint32_t reference_finished;//Frames finished at the reference (needs more)
+}session_result_t;
+
+typedef struct{
+    const char* rom_name;
+    const rom_entry_t* entry;   //NULL when the rom is not in the library
+    config_t* config;
+    const uint16_t* input;      //Recorded session, NULL for scripted ones
+    bool loaded;
+    uint32_t current_ips;       //Clock before tuning
+    uint32_t tuned_ips;         //Clock to save, current_ips when nothing is saved
+    uint32_t needed_ips;        //Starved at its own clock: lowest clock that keeps up, else 0
+    uint32_t finished_frames;   //Frames finished at the rom's own clock
+    uint32_t reference_finished;//Frames finished at the reference
+    uint32_t latency;           //Frames the tuned clock may lag, 0 when identical
+    bool cpu_paced;             //No clock away from the reference matches it
+    uint32_t sessions_played;   //Sessions past the startup path
+    bool disagree;              //Sessions gave different verdicts, nothing saved
+    uint32_t spin_ips;          //Above this clock every frame ends in an idle loop
+    double spin_share;          //Share of the reference runs spent spinning
+    fault_t fault;
+}autotune_job_t;
+
+//Opcodes writing the display or ram, a loop running one of them is not idle
+bool writes_memory(uint16_t opcode){
+    const uint8_t NN = opcode & 0X00FF;
+    switch((opcode>>12) & 0X000F){
+        case 0x00: return NN == 0XE0;
+        case 0x0D: return true;
+        case 0x0F: return NN == 0X33 || NN == 0X55;
+        default:   return false;
+    }
+}
+
+//Opcodes reading the keypad
+bool reads_keypad(uint16_t opcode){
+    const uint16_t op = opcode & 0XF0FF;
+    return op == 0XE09E || op == 0XE0A1 || op == 0XF00A;
+}
+
+//Run the session (keys of every frame) for session_frames frames at `ips`.
+//The random source is part of the recording: CXNN is reseeded every frame, otherwise a
+//loop waiting for a key while drawing random numbers would change the game at every clock.
+//Keys and timers only change between frames, so a backward jump (or FX0A waiting) that lands
+//with the same registers as the last one, with nothing written in between, will keep looping
+//the same way until the frame ends: the rest of the frame is idle spinning.
+void record_frames(const chip8_t* start, const config_t* config, const uint16_t* keys, uint32_t ips,
+                   frame_record_t* record){
+    config_t rate_config = *config;
+    rate_config.instructions_per_second = ips;
+    const uint32_t per_frame = ips / 60;
+
+    chip8_t chip8;
+    fork_chip8(&chip8, start);
+    record->executed = 0;
+    record->spin_instructions = 0;
+    record->busiest_frame = 0;
+    record->finished_frames = 0;
+    memset(record->reached, 0, sizeof(record->reached));
+    record->reads_keys = false;
+    record->fault = FAULT_NONE;
+
+    for(uint32_t frame=0;frame<config->session_frames;frame++){
+        //Registers at the last backward jump of this frame
+        struct{
+            uint16_t PC, I;
+            uint8_t V[16];
+            size_t stack_depth;
+        }mark = {0};
+        bool have_mark = false, written = false, spinning = false;
+        uint32_t busy = 0;
+        chip8.rand_state = hash32(config->seed ^ hash32(frame)) | 1;
+        if(frame > 0) update_chip8_timer(&chip8);
+        set_keypad(&chip8, keys[frame]);
+
+        for(uint32_t i=0;i<per_frame && record->fault == FAULT_NONE;i++){
+            record->fault = check_instruction(&chip8, &rate_config);
+            if(record->fault != FAULT_NONE) break;
+
+            const uint16_t pc = chip8.PC;
+            const uint16_t opcode = (chip8.ram[pc])<<8 | chip8.ram[pc+1];
+            emulate_instruction(&chip8, &rate_config);
+            record->executed++;
+            if(spinning){
+                record->spin_instructions++;
+                continue;
+            }
+            busy++;
+            record->reached[pc>>3] |= 1u << (pc & 7);
+            record->reads_keys |= reads_keypad(opcode);
+            written |= writes_memory(opcode);
+            if(chip8.PC <= pc){
+                const size_t stack_depth = chip8.stack_ptr - &chip8.stack[0];
+                spinning = have_mark && !written && mark.PC == chip8.PC && mark.I == chip8.I
+                        && mark.stack_depth == stack_depth
+                        && memcmp(mark.V, chip8.V, sizeof(mark.V)) == 0;
+                mark.PC = chip8.PC;
+                mark.I = chip8.I;
+                mark.stack_depth = stack_depth;
+                memcpy(mark.V, chip8.V, sizeof(mark.V));
+                have_mark = true;
+                written = false;
+            }
+        }
+        if(busy > record->busiest_frame) record->busiest_frame = busy;
+        record->hashes[frame] = record->fault == FAULT_NONE ? hash_bytes(chip8.display, sizeof(chip8.display)) : 0;
+        record->finished[frame] = spinning;
+        record->finished_frames += spinning;
+    }
+}
+
+//True if every reference frame after the first `settle` shows up in the probe, in order and
+//at most `latency` frames late. Probe frames in between (drawing not finished yet) are skipped.
+bool frames_match(const frame_record_t* probe, const frame_record_t* reference, uint32_t frames,
+                  uint32_t settle, uint32_t latency){
+    uint32_t j = 0;
+    for(uint32_t f=settle; f + latency < frames; f++){
+        if(j < f) j = f;
+        while(j <= f + latency && probe->hashes[j] != reference->hashes[f]) j++;
+        if(j > f + latency) return false;
+    }
+    return true;
+}
+
+//Lowest rung in [low, high] whose frames match, high + 1 if none does
+uint32_t search_clock(const chip8_t* start, const config_t* config, const uint16_t* keys,
+                      const frame_record_t* reference, frame_record_t* probe,
+                      uint32_t low, uint32_t high, uint32_t settle, uint32_t latency){
+    record_frames(start, config, keys, high * 60, probe);
+    if(!frames_match(probe, reference, config->session_frames, settle, latency)) return high + 1;
+    while(low < high){
+        const uint32_t mid = low + (high - low) / 2;
+        record_frames(start, config, keys, mid * 60, probe);
+        if(frames_match(probe, reference, config->session_frames, settle, latency)) high = mid;
+        else low = mid + 1;
+    }
+    return low;
+}
+
+//Tune the rom on one session, `reference` already holds its run at reference_ips
+void tune_session(const chip8_t* start, const config_t* config, const uint16_t* keys, uint32_t current_ips,
+                  const frame_record_t* reference, frame_record_t* probe, session_result_t* result){
+    *result = (session_result_t){.verdict = SESSION_CPU_PACED, .ips = current_ips};
+
+    //Ladder 60, 120, ... up to the rom's clock. Above the busiest frame every frame already ends
+    //idle at the reference, so no rung past it is needed.
+    const uint32_t reference_rung = config->reference_ips / 60;
+    uint32_t high = current_ips / 60;
+    if(high > reference_rung) high = reference_rung;
+    if(high > reference->busiest_frame) high = reference->busiest_frame;
+    if(high < 1) high = 1;
+
+    uint32_t rung = search_clock(start, config, keys, reference, probe, 1, high, 0, 0);
+    if(rung > high && config->latency_frames > 0){
+        //Frames may lag when asked for, but the busiest frame of the whole session (the settle
+        //frames too, that is where most roms draw) still has to be done within latency + 1 frames
+        result->latency = config->latency_frames;
+        const uint32_t per_frame = (reference->busiest_frame + result->latency) / (result->latency + 1);
+        const uint32_t low = per_frame > 1 ? per_frame : 1;
+        rung = low > high ? high + 1
+             : search_clock(start, config, keys, reference, probe, low, high, config->settle_frames, result->latency);
+    }
+
+    if(rung <= high){
+        //Lower (or the same): cpu pacing if the rom only matches next to the reference
+        if(rung + CPU_PACED_RUNGS < reference_rung && rung * 60 < current_ips){
+            result->verdict = SESSION_LOWERS;
+            result->ips = rung * 60;
+        }else if(rung + CPU_PACED_RUNGS < reference_rung){
+            result->verdict = SESSION_KEEPS;
+        }
+        return;
+    }
+    result->latency = 0;
+
+    //Nothing at or under the rom's clock gives the same frames. Does it wait on the timers
+    //at the reference, and is it starved at its own clock?
+    result->reference_finished = reference->finished_frames;
+    record_frames(start, config, keys, high * 60, probe);
+    result->finished_frames = probe->finished_frames;
+    const uint32_t keep_up = reference->finished_frames * KEEP_UP_PERCENT / 100;
+    const bool waits = reference->finished_frames * 100 >= config->session_frames * FINISHED_FRAMES_PERCENT;
+    const uint32_t top = reference_rung > CPU_PACED_RUNGS ? reference_rung - CPU_PACED_RUNGS - 1 : 0;
+    if(!waits || top <= high) return;
+    result->verdict = SESSION_KEEPS;
+    if(probe->finished_frames * 100 >= reference->finished_frames * STARVED_PERCENT) return;
+
+    //Lowest faster clock that keeps up
+    uint32_t low = high + 1, up = top;
+    record_frames(start, config, keys, up * 60, probe);
+    if(probe->finished_frames < keep_up){
+        result->verdict = SESSION_CPU_PACED;
+        return;
+    }
+    while(low < up){
+        const uint32_t mid = low + (up - low) / 2;
+        record_frames(start, config, keys, mid * 60, probe);
+        if(probe->finished_frames >= keep_up) up = mid;
+        else low = mid + 1;
+    }
+    result->verdict = SESSION_NEEDS_MORE;
+    result->ips = low * 60;
+}
+
+//True if `reached` ran a PC that `idle` never did
+bool reaches_new_code(const uint8_t* reached, const uint8_t* idle, size_t size){
+    for(size_t i=0;i<size;i++){
+        if(reached[i] & ~idle[i]) return true;
+    }
+    return false;
+}
+
+void run_autotune_job(int i, void* data){
+    autotune_job_t* job = &((autotune_job_t*)data)[i];
+    const config_t* config = job->config;
+    chip8_t start = {0};
+    start.rand_state = hash32(config->seed);
+    if(!load_batch_rom(&start, config, job->rom_name, job->entry)) return;
+    //--ips wins over the library, like in play mode
+    job->current_ips = (job->entry != NULL && !config->ips_set) ? job->entry->instructions_per_second
+                                                                : config->instructions_per_second;
+    job->tuned_ips = job->current_ips;
+
+    const uint32_t frames = config->session_frames;
+    frame_record_t reference = {.hashes = calloc(frames, sizeof(uint64_t)), .finished = calloc(frames, 1)};
+    frame_record_t probe = {.hashes = calloc(frames, sizeof(uint64_t)), .finished = calloc(frames, 1)};
+    uint16_t* keys = calloc(frames, sizeof(uint16_t));
+    if(reference.hashes != NULL && probe.hashes != NULL && reference.finished != NULL && probe.finished != NULL
+       && keys != NULL){
+        job->loaded = true;
+        //Code the rom runs without any key: its startup path
+        record_frames(&start, config, keys, config->reference_ips, &probe);
+        uint8_t idle[sizeof(probe.reached)];
+        memcpy(idle, probe.reached, sizeof(idle));
+
+        session_result_t agreed = {0};
+        uint64_t executed = 0, spin_instructions = 0;
+        uint32_t busiest_frame = 0;
+        const uint32_t session_count = job->input != NULL ? 1 : config->sessions;
+        for(uint32_t s=0;s<session_count;s++){
+            config_t session_config = *config;
+            session_config.seed = config->seed + s;
+            const uint16_t* session = job->input;
+            if(session == NULL){
+                for(uint32_t frame=0;frame<frames;frame++) keys[frame] = session_keys(session_config.seed, frame);
+                session = keys;
+            }
+            record_frames(&start, &session_config, session, config->reference_ips, &reference);
+            if(job->fault == FAULT_NONE) job->fault = reference.fault;
+            executed += reference.executed;
+            spin_instructions += reference.spin_instructions;
+            if(reference.busiest_frame > busiest_frame) busiest_frame = reference.busiest_frame;
+            if(reference.reads_keys && !reaches_new_code(reference.reached, idle, sizeof(idle))) continue;
+
+            session_result_t result;
+            tune_session(&start, &session_config, session, job->current_ips, &reference, &probe, &result);
+            job->cpu_paced |= result.verdict == SESSION_CPU_PACED;
+            if(job->sessions_played++ == 0){
+                agreed = result;
+                continue;
+            }
+            //Keep the clock every session is fine with
+            job->disagree |= result.verdict != agreed.verdict;
+            const uint32_t latency = result.latency > agreed.latency ? result.latency : agreed.latency;
+            if(result.ips > agreed.ips) agreed = result;
+            agreed.latency = latency;
+        }
+        job->spin_share = executed ? (double)spin_instructions / executed : 0;
+        job->spin_ips = busiest_frame * 60;
+        if(job->spin_ips < 60) job->spin_ips = 60;
+
+        //One session pacing the rom by the cpu, or sessions that disagree, leave the clock alone
+        if(job->sessions_played > 0 && !job->cpu_paced && !job->disagree){
+            if(agreed.verdict == SESSION_LOWERS){
+                job->tuned_ips = agreed.ips;
+                job->latency = agreed.latency;
+            }else if(agreed.verdict == SESSION_NEEDS_MORE){
+                job->needed_ips = agreed.ips;
+                job->finished_frames = agreed.finished_frames;
+                job->reference_finished = agreed.reference_finished;
+                if(config->raise) job->tuned_ips = agreed.ips;
+            }
+        }
+    }
+    free(reference.hashes);
+    free(reference.finished);
+    free(probe.hashes);
+    free(probe.finished);
+    free(keys);
+}
+
+//Write the library again with the tuned profiles, bodies are copied from the mapped pack
+bool save_speed_profiles(const config_t* config, const autotune_job_t* jobs, int job_count, int* saved){
+    const rom_library_t* library = config->library;
+    const uint32_t rom_count = library->header->rom_count;
+    rom_entry_t* entries = malloc(rom_count * sizeof(rom_entry_t));
+    if(entries == NULL) return false;
+    memcpy(entries, library->entries, rom_count * sizeof(rom_entry_t));
+    *saved = 0;
+    for(int i=0;i<job_count;i++){
+        const autotune_job_t* job = &jobs[i];
+        if(!job->loaded || job->entry == NULL || job->cpu_paced || job->tuned_ips == job->current_ips) continue;
+        rom_entry_t* entry = &entries[job->entry - library->entries];
+        entry->instructions_per_second = job->tuned_ips;
+        entry->tuned = true;
+        (*saved)++;
+    }
+    const uint32_t bodies_offset = sizeof(rom_library_header_t) + rom_count * sizeof(rom_entry_t);
+    const bool ok = *saved == 0 || write_rom_library(config->library_path, library->header, entries,
+                                                     library->data + bodies_offset, library->size - bodies_offset);
+    if(!ok) *saved = 0;
+    free(entries);
+    return ok;
+}
+
+//Read a keypad session recorded by play mode (--record): a little endian key mask per frame
+uint16_t* load_keypad_session(const char* path, uint32_t* frames){
+    FILE* file = fopen(path, "rb");
+    if(!file){
+        SDL_Log("Could not open keypad session %s\n", path);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    rewind(file);
+    *frames = size > 0 ? (uint32_t)(size / 2) : 0;
+    uint16_t* keys = *frames > 0 ? malloc(*frames * sizeof(uint16_t)) : NULL;
+    uint8_t mask[2];
+    for(uint32_t frame=0; keys != NULL && frame<*frames; frame++){
+        if(fread(mask, sizeof(mask), 1, file) != 1){
+            free(keys);
+            keys = NULL;
+            break;
+        }
+        keys[frame] = mask[0] | mask[1]<<8;
+    }
+    fclose(file);
+    if(keys == NULL) SDL_Log("Keypad session %s is empty or could not be read\n", path);
+    return keys;
+}
+
+//Tune every rom on all cores, save the profiles into the library when there is one
+bool run_autotune(config_t* config){
+    const int job_count = batch_rom_count(config);
+    if(job_count == 0){
+        fprintf(stderr,"Nothing to tune, give roms and/or --library <pack>\n");
+        return false;
+    }
+    //A recorded session sets the length of the run
+    uint16_t* input = NULL;
+    if(config->input_path != NULL){
+        input = load_keypad_session(config->input_path, &config->session_frames);
+        if(input == NULL) return false;
+    }
+    autotune_job_t* jobs = calloc(job_count, sizeof(autotune_job_t));
+    if(jobs == NULL){
+        free(input);
+        return false;
+    }
+    for(int i=0;i<job_count;i++){
+        jobs[i].config = config;
+        jobs[i].input = input;
+        batch_rom(config, i, &jobs[i].rom_name, &jobs[i].entry);
+    }
+    const int thread_count = run_jobs(run_autotune_job, jobs, job_count);
+
+    int failed = 0, saved = 0;
+    for(int i=0;i<job_count;i++){
+        const autotune_job_t* job = &jobs[i];
+        if(!job->loaded){
+            printf("FAIL  %s: could not load\n", job->rom_name);
+            failed++;
+            continue;
+        }
+        if(job->sessions_played == 0)
+            printf("  idle   %s: no session gets past the startup path, keeps %u ips", job->rom_name, job->current_ips);
+        else if(job->cpu_paced)
+            printf("  cpu    %s: paced by the cpu, keeps %u ips", job->rom_name, job->current_ips);
+        else if(job->disagree)
+            printf("  mixed  %s: sessions disagree, keeps %u ips", job->rom_name, job->current_ips);
+        else if(job->tuned_ips < job->current_ips)
+            printf("%5u ips %s: was %u ips", job->tuned_ips, job->rom_name, job->current_ips);
+        else if(job->needed_ips)
+            printf("%5u ips %s: %s, finishes %u of %u frames at %u ips, %u at %u ips", job->needed_ips, job->rom_name,
+                   config->raise ? "raised" : "needs more (save with --raise)",
+                   job->finished_frames, config->session_frames, job->current_ips,
+                   job->reference_finished, config->reference_ips);
+        else
+            printf("  same   %s: keeps %u ips", job->rom_name, job->current_ips);
+        if(job->tuned_ips < job->current_ips && job->latency) printf(", frames up to %u late", job->latency);
+        else if(job->tuned_ips < job->current_ips) printf(", frames identical");
+        if(job->sessions_played > 0)
+            printf(", %u of %u sessions", job->sessions_played, input != NULL ? 1 : config->sessions);
+        if(job->spin_ips < config->reference_ips)
+            printf(", every frame spins above %u ips", job->spin_ips);
+        printf(", %.0f%% of the %u ips run spinning%s%s\n", job->spin_share * 100, config->reference_ips,
+               job->fault != FAULT_NONE ? ", hit " : "",
+               job->fault != FAULT_NONE ? fault_names[job->fault] : "");
+    }
+    if(config->library != NULL && !save_speed_profiles(config, jobs, job_count, &saved)) failed++;
+
+    printf("%d roms checked over %u frames on %d threads, %d profiles saved%s\n", job_count, config->session_frames,
+           thread_count, saved, config->library ? "" : " (use --library <pack> to keep them)");
+    free(jobs);
+    free(input);
+    return failed == 0;
+}
+
+//================ Input fuzzer ================
+//Explores a rom by mutating keypad inputs (one key mask per frame). The corpus keeps every
+//input that reached a new PC edge, with a snapshot of the machine every SNAPSHOT_FRAMES
+//frames: a mutation forks the machine at a snapshot and only runs the frames after it.
+//A crash is any fault check_instruction() reports, its input is minimized at the end.
+
+#define SNAPSHOT_FRAMES 60
+#define CORPUS_MAX      256
+#define CRASHES_MAX     16
+#define COVERAGE_MAP_SIZE 0x10000   //Edges (previous PC, PC) hashed into one byte each
+
+//Edges one run took, each listed once, so merging costs the edges taken, not the map
+typedef struct{
+    uint32_t* seen;             //Run that last took each edge
+    uint32_t run;
+    uint16_t* edges;
+    uint32_t count;
+}edge_trace_t;
+
+typedef struct{
+    uint16_t* input;            //Keys of every frame
+    chip8_t* snapshots;         //Machine at the start of frame 0, SNAPSHOT_FRAMES, ...
+    uint32_t snapshot_count;    //Snapshots taken, fewer when the input ends in a crash
+}corpus_entry_t;
+
+typedef struct{
+    fault_t fault;
+    uint16_t pc;                //Where the fault happens, crashes are unique by (fault, pc)
+    uint16_t* input;
+    uint32_t frames;            //Input length, the fault happens in the last frame
+    uint32_t found_frames;      //Length before minimizing
+}fuzz_crash_t;
+
+//One rom, fuzzed by every core
+typedef struct{
+    config_t config;            //Copy, with the rom's clock
+    chip8_t start;
+    uint32_t snapshot_count;
+    uint64_t deadline;          //SDL_GetPerformanceCounter() value to stop at
+    SDL_atomic_t coverage[COVERAGE_MAP_SIZE]; //Set once with SDL_AtomicCAS(), no lock needed
+    SDL_mutex* lock;            //Guards everything below
+    corpus_entry_t corpus[CORPUS_MAX];
+    int corpus_count;
+    fuzz_crash_t crashes[CRASHES_MAX];
+    int crash_count;
+    uint64_t execs;
+    uint64_t instructions;
+}fuzz_campaign_t;
+
+bool init_edge_trace(edge_trace_t* trace){
+    trace->seen = calloc(COVERAGE_MAP_SIZE, sizeof(uint32_t));
+    trace->edges = malloc(COVERAGE_MAP_SIZE * sizeof(uint16_t));
+    trace->run = 0;
+    trace->count = 0;
+    return trace->seen != NULL && trace->edges != NULL;
+}
+
+void free_edge_trace(edge_trace_t* trace){
+    free(trace->seen);
+    free(trace->edges);
+}
+
+//Start listing the edges of a new run
+void reset_edge_trace(edge_trace_t* trace){
+    trace->count = 0;
+    if(++trace->run == 0){
+        memset(trace->seen, 0, COVERAGE_MAP_SIZE * sizeof(uint32_t));
+        trace->run = 1;
+    }
+}
+
+//Add the edges of a run to the campaign coverage, true if one of them is new
+bool merge_coverage(fuzz_campaign_t* campaign, const edge_trace_t* trace){
+    bool new_coverage = false;
+    for(uint32_t i=0;i<trace->count;i++){
+        SDL_atomic_t* edge = &campaign->coverage[trace->edges[i]];
+        if(SDL_AtomicGet(edge) == 0 && SDL_AtomicCAS(edge, 0, 1)) new_coverage = true;
+    }
+    return new_coverage;
+}
+
+//Run frames [from, frames) of an input, trace the edges taken and snapshot the machine on the way.
+//Return the fault that stopped the run (its frame in *fault_frame), or FAULT_NONE.
+fault_t run_input(chip8_t* chip8, config_t* config, const uint16_t* input, uint32_t from, uint32_t frames,
+                  edge_trace_t* trace, chip8_t* snapshots, uint32_t* fault_frame, uint64_t* executed){
+    const uint32_t per_frame = config->instructions_per_second / 60;
+    for(uint32_t frame=from;frame<frames;frame++){
+        if(snapshots != NULL && frame % SNAPSHOT_FRAMES == 0) fork_chip8(&snapshots[frame / SNAPSHOT_FRAMES], chip8);
+        if(frame > 0) update_chip8_timer(chip8);
+        set_keypad(chip8, input[frame]);
+        for(uint32_t i=0;i<per_frame;i++){
+            const fault_t fault = check_instruction(chip8, config);
+            if(fault != FAULT_NONE){
+                *fault_frame = frame;
+                return fault;
+            }
+            const uint16_t pc = chip8->PC;
+            emulate_instruction(chip8, config);
+            (*executed)++;
+            if(trace != NULL){
+                const uint16_t edge = ((pc << 4) ^ chip8->PC) & (COVERAGE_MAP_SIZE-1);
+                if(trace->seen[edge] != trace->run){
+                    trace->seen[edge] = trace->run;
+                    trace->edges[trace->count++] = edge;
+                }
+            }
+        }
+    }
+    return FAULT_NONE;
+}
+
+//Replay an input from power on, true if it runs into the given crash.
+//*used is the number of frames up to and including the one that faulted.
+bool reproduces_crash(fuzz_campaign_t* campaign, const uint16_t* input, uint32_t frames, const fuzz_crash_t* crash,
+                      uint32_t* used){
+    chip8_t chip8;
+    fork_chip8(&chip8, &campaign->start);
+    uint32_t fault_frame = 0;
+    uint64_t executed = 0;
+    const fault_t fault = run_input(&chip8, &campaign->config, input, 0, frames, NULL, NULL, &fault_frame, &executed);
+    *used = fault_frame + 1;
+    return fault == crash->fault && chip8.PC == crash->pc;
+}
+
+//Make a crashing input shorter and quieter: drop chunks of frames, then release keys,
+//halving the chunk size each round, keeping every change that still crashes the same way.
+//A kept change is cut at the frame that faults, which can come earlier than before.
+void minimize_crash(fuzz_campaign_t* campaign, fuzz_crash_t* crash){
+    uint16_t* candidate = malloc(crash->frames * sizeof(uint16_t));
+    if(candidate == NULL) return;
+    int replays = 4096; //Budget, an input of 1200 frames needs far less
+
+    for(uint32_t chunk=crash->frames/2; chunk>0 && replays>0; chunk/=2){
+        //Drop frames
+        for(uint32_t at=0; at+chunk<=crash->frames && crash->frames>chunk && replays>0; replays--){
+            memcpy(candidate, crash->input, at * sizeof(uint16_t));
+            memcpy(candidate + at, crash->input + at + chunk, (crash->frames - at - chunk) * sizeof(uint16_t));
+            uint32_t used;
+            if(reproduces_crash(campaign, candidate, crash->frames - chunk, crash, &used)){
+                crash->frames = used;
+                memcpy(crash->input, candidate, crash->frames * sizeof(uint16_t));
+            }else{
+                at += chunk;
+            }
+        }
+        //Release keys
+        for(uint32_t at=0; at<crash->frames && replays>0; at+=chunk){
+            const uint32_t length = (crash->frames - at < chunk) ? crash->frames - at : chunk;
+            bool pressed = false;
+            for(uint32_t i=0;i<length;i++) pressed |= crash->input[at+i] != 0;
+            if(!pressed) continue;
+            memcpy(candidate, crash->input, crash->frames * sizeof(uint16_t));
+            memset(candidate + at, 0, length * sizeof(uint16_t));
+            replays--;
+            uint32_t used;
+            if(reproduces_crash(campaign, candidate, crash->frames, crash, &used)){
+                crash->frames = used;
+                memcpy(crash->input, candidate, crash->frames * sizeof(uint16_t));
+            }
+        }
+    }
+    free(candidate);
+}
+
+//Add a run to the corpus. Snapshots before `from` are the parent's, the run filled the rest
+//up to snapshot_count. Called with the lock held.
+void add_corpus_entry(fuzz_campaign_t* campaign, const uint16_t* input, const corpus_entry_t* parent,
+                      uint32_t from, const chip8_t* snapshots, uint32_t snapshot_count){
+    if(campaign->corpus_count >= CORPUS_MAX) return;
+    const uint32_t frames = campaign->config.session_frames;
+    corpus_entry_t entry = {
+        .input = malloc(frames * sizeof(uint16_t)),
+        .snapshots = malloc(snapshot_count * sizeof(chip8_t)),
+        .snapshot_count = snapshot_count,
+    };
+    if(entry.input == NULL || entry.snapshots == NULL){
+        free(entry.input);
+        free(entry.snapshots);
+        return;
+    }
+    memcpy(entry.input, input, frames * sizeof(uint16_t));
+    for(uint32_t i=0;i<snapshot_count;i++)
+        fork_chip8(&entry.snapshots[i], (parent != NULL && i < from / SNAPSHOT_FRAMES) ? &parent->snapshots[i] : &snapshots[i]);
+    campaign->corpus[campaign->corpus_count++] = entry;
+}
+
+//Keep the input of a new (fault, pc) crash, minimized at the end. Called with the lock held.
+void record_crash(fuzz_campaign_t* campaign, fault_t fault, uint16_t pc, const uint16_t* input, uint32_t fault_frame){
+    for(int i=0;i<campaign->crash_count;i++)
+        if(campaign->crashes[i].fault == fault && campaign->crashes[i].pc == pc) return;
+    if(campaign->crash_count >= CRASHES_MAX) return;
+    fuzz_crash_t* crash = &campaign->crashes[campaign->crash_count];
+    crash->input = malloc((fault_frame + 1) * sizeof(uint16_t));
+    if(crash->input == NULL) return;
+    memcpy(crash->input, input, (fault_frame + 1) * sizeof(uint16_t));
+    crash->fault = fault;
+    crash->pc = pc;
+    crash->frames = crash->found_frames = fault_frame + 1;
+    campaign->crash_count++;
+}
+
+//Snapshots a run leaves: all of them, or the ones taken up to the frame that faulted
+uint32_t snapshots_taken(const fuzz_campaign_t* campaign, fault_t fault, uint32_t fault_frame){
+    return fault == FAULT_NONE ? campaign->snapshot_count : fault_frame / SNAPSHOT_FRAMES + 1;
+}
+
+//Change the keys of frames [from, frames): hold a key for a while, release, flip one key
+void mutate_input(uint16_t* input, uint32_t from, uint32_t frames, uint32_t* rng){
+    const uint32_t operations = 1 + (hash32(++*rng) & 3);
+    for(uint32_t n=0;n<operations;n++){
+        const uint32_t at = from + hash32(++*rng) % (frames - from);
+        uint32_t length = 1 + hash32(++*rng) % 32;
+        if(length > frames - at) length = frames - at;
+        const uint32_t key = hash32(++*rng);
+        for(uint32_t i=at;i<at+length;i++){
+            switch(key >> 30){
+                case 0:  input[i] = 0; break;                           //Release everything
+                case 1:  input[i] ^= (uint16_t)(1u << (key & 0xF)); break; //Flip one key
+                default: input[i] = (uint16_t)(1u << (key & 0xF)); break;  //Hold one key
+            }
+        }
+    }
+}
+
+void fuzz_worker(int worker, void* data){
+    fuzz_campaign_t* campaign = data;
+    config_t* config = &campaign->config;
+    const uint32_t frames = config->session_frames;
+    uint16_t* input = malloc(frames * sizeof(uint16_t));
+    chip8_t* snapshots = malloc(campaign->snapshot_count * sizeof(chip8_t));
+    edge_trace_t trace;
+    const bool traced = init_edge_trace(&trace);
+    uint32_t rng = hash32(config->seed ^ (uint32_t)(worker + 1) * 0x9E3779B9);
+    uint64_t execs = 0, instructions = 0;
+    if(input == NULL || snapshots == NULL || !traced) goto done;
+
+    while(SDL_GetPerformanceCounter() < campaign->deadline){
+        //Pick a corpus entry and a snapshot to fork from. Entries are never changed once added.
+        SDL_LockMutex(campaign->lock);
+        const corpus_entry_t* parent = &campaign->corpus[hash32(++rng) % campaign->corpus_count];
+        SDL_UnlockMutex(campaign->lock);
+        const uint32_t from = (hash32(++rng) % parent->snapshot_count) * SNAPSHOT_FRAMES;
+        if(from >= frames) continue;
+        memcpy(input, parent->input, frames * sizeof(uint16_t));
+        mutate_input(input, from, frames, &rng);
+
+        chip8_t chip8;
+        fork_chip8(&chip8, &parent->snapshots[from / SNAPSHOT_FRAMES]);
+        reset_edge_trace(&trace);
+        uint32_t fault_frame = 0;
+        const fault_t fault = run_input(&chip8, config, input, from, frames, &trace, snapshots, &fault_frame, &instructions);
+        execs++;
+
+        //Most runs find nothing new and never take the lock
+        const bool new_coverage = merge_coverage(campaign, &trace);
+        if(fault == FAULT_NONE && !new_coverage) continue;
+        SDL_LockMutex(campaign->lock);
+        if(fault != FAULT_NONE) record_crash(campaign, fault, chip8.PC, input, fault_frame);
+        //A crashing input can still be forked before the frame that faulted
+        if(new_coverage)
+            add_corpus_entry(campaign, input, parent, from, snapshots, snapshots_taken(campaign, fault, fault_frame));
+        SDL_UnlockMutex(campaign->lock);
+    }
+done:
+    SDL_LockMutex(campaign->lock);
+    campaign->execs += execs;
+    campaign->instructions += instructions;
+    SDL_UnlockMutex(campaign->lock);
+    free(input);
+    free(snapshots);
+    free_edge_trace(&trace);
+}
+
+void minimize_worker(int i, void* data){
+    fuzz_campaign_t* campaign = data;
+    minimize_crash(campaign, &campaign->crashes[i]);
+}
+
+//Print keys as runs: "120x0000 8x0020 ..."
+void print_input(const uint16_t* input, uint32_t frames){
+    for(uint32_t i=0;i<frames;){
+        uint32_t run = 1;
+        while(i + run < frames && input[i + run] == input[i]) run++;
+        printf(" %ux%04X", run, input[i]);
+        i += run;
+    }
+    printf("\n");
+}
+
+//Fuzz one rom on every core for fuzz_seconds
+bool fuzz_rom(const config_t* rom_config, const char* rom_name, const rom_entry_t* entry){
+    fuzz_campaign_t* campaign = calloc(1, sizeof(fuzz_campaign_t));
+    if(campaign == NULL) return false;
+    config_t* config = &campaign->config;
+    *config = *rom_config;
+    //Fuzz at the rom's speed profile unless the clock was given
+    if(entry != NULL && !config->ips_set) config->instructions_per_second = entry->instructions_per_second;
+    campaign->start.rand_state = hash32(config->seed);
+    campaign->snapshot_count = (config->session_frames + SNAPSHOT_FRAMES - 1) / SNAPSHOT_FRAMES;
+    campaign->lock = SDL_CreateMutex();
+    bool ok = campaign->lock != NULL && load_batch_rom(&campaign->start, config, rom_name, entry);
+
+    //Seed the corpus with the idle input and the scripted session keys
+    uint16_t* input = ok ? malloc(config->session_frames * sizeof(uint16_t)) : NULL;
+    chip8_t* snapshots = ok ? malloc(campaign->snapshot_count * sizeof(chip8_t)) : NULL;
+    edge_trace_t trace;
+    const bool traced = init_edge_trace(&trace);
+    ok = ok && input != NULL && snapshots != NULL && traced;
+    for(int seed_input=0; ok && seed_input<2; seed_input++){
+        for(uint32_t frame=0;frame<config->session_frames;frame++)
+            input[frame] = seed_input ? session_keys(config->seed, frame) : 0;
+        chip8_t chip8;
+        fork_chip8(&chip8, &campaign->start);
+        uint32_t fault_frame = 0;
+        uint64_t executed = 0;
+        reset_edge_trace(&trace);
+        const fault_t fault = run_input(&chip8, config, input, 0, config->session_frames, &trace, snapshots,
+                                        &fault_frame, &executed);
+        merge_coverage(campaign, &trace);
+        //A seed that crashes is a crash like any other, and is fuzzed from the snapshots before it
+        if(fault != FAULT_NONE) record_crash(campaign, fault, chip8.PC, input, fault_frame);
+        add_corpus_entry(campaign, input, NULL, 0, snapshots, snapshots_taken(campaign, fault, fault_frame));
+    }
+    free(input);
+    free(snapshots);
+    free_edge_trace(&trace);
+    ok = ok && campaign->corpus_count > 0;
+    if(!ok) printf("FAIL  %s: could not load\n", rom_name);
+
+    if(ok){
+        const uint64_t start_counts = SDL_GetPerformanceCounter();
+        campaign->deadline = start_counts + (uint64_t)config->fuzz_seconds * SDL_GetPerformanceFrequency();
+        const int thread_count = run_jobs(fuzz_worker, campaign, SDL_GetCPUCount());
+        const double seconds = (double)(SDL_GetPerformanceCounter() - start_counts) / SDL_GetPerformanceFrequency();
+        run_jobs(minimize_worker, campaign, campaign->crash_count);
+
+        uint32_t edge_count = 0;
+        for(uint32_t i=0;i<COVERAGE_MAP_SIZE;i++) edge_count += SDL_AtomicGet(&campaign->coverage[i]);
+        printf("%s: %u edges, corpus %d, %d crashes, %llu execs (%.0f execs/s, %.1f M instructions/s) on %d threads\n",
+               rom_name, edge_count, campaign->corpus_count, campaign->crash_count,
+               (unsigned long long)campaign->execs, seconds > 0 ? campaign->execs / seconds : 0.0,
+               seconds > 0 ? campaign->instructions / seconds / 1e6 : 0.0, thread_count);
+        for(int i=0;i<campaign->crash_count;i++){
+            const fuzz_crash_t* crash = &campaign->crashes[i];
+            printf("  crash: %s at PC 0x%04X, frame %u (minimized from %u frames), keys:",
+                   fault_names[crash->fault], crash->pc, crash->frames - 1, crash->found_frames);
+            print_input(crash->input, crash->frames);
+        }
+    }
+
+    for(int i=0;i<campaign->corpus_count;i++){
+        free(campaign->corpus[i].input);
+        free(campaign->corpus[i].snapshots);
+    }
+    for(int i=0;i<campaign->crash_count;i++) free(campaign->crashes[i].input);
+    if(campaign->lock != NULL) SDL_DestroyMutex(campaign->lock);
+    free(campaign);
+    return ok;
+}
+
+bool run_input_fuzzer(config_t* config){
+    const int rom_count = batch_rom_count(config);
+    if(rom_count == 0){
+        fprintf(stderr,"Nothing to fuzz, give roms and/or --library <pack>\n");
+        return false;
+    }
+    int failed = 0;
+    for(int i=0;i<rom_count;i++){
+        const char* rom_name;
+        const rom_entry_t* entry;
+        batch_rom(config, i, &rom_name, &entry);
+        if(!fuzz_rom(config, rom_name, entry)) failed++;
+    }
+    return failed == 0;
+}
+
 int main(int argc, char **argv){
     
-    // Uasage message for miss args
-    if(argc<2){
-        fprintf(stderr,"Usage: %s <rom_name>\n",argv[0]);// Usage ./chip <rome_name>
-        
-    }
     //Initialize Config
     config_t config = {0};
-    set_config(&config,argc,argv);//Set some default config
+    // Uasage message for miss args
+    if(!set_config(&config,argc,argv) || (config.rom_count==0 && config.mode==MODE_PLAY)){
+        fprintf(stderr,"Usage: %s [--ips N] [--record FILE] <rom_name>\n",argv[0]);// Usage ./chip <rome_name>
+        fprintf(stderr,"       %s --conform [--library PACK] [--fuzz STREAMS] [--interval N] [--instructions N] [--seed S] [roms...]\n",argv[0]);
+        fprintf(stderr,"       %s --build-library PACK [--ips N] roms...\n",argv[0]);
+        fprintf(stderr,"       %s --autotune [--library PACK] [--ips N] [--reference-ips N] [--latency N] [--settle N] [--raise] [--input FILE | --sessions N] [--frames N] [--seed S] [roms...]\n",argv[0]);
+        fprintf(stderr,"       %s --fuzz-input [--library PACK] [--seconds N] [--frames N] [--ips N] [--seed S] [roms...]\n",argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    //Headless modes don't open a window
+    if(config.mode == MODE_BUILD_LIBRARY) exit(build_rom_library(&config) ? EXIT_SUCCESS : EXIT_FAILURE);
+    rom_library_t library = {0};
+    //Play mode picks up the default library (speed profiles, notes) when it is there
+    const bool default_library = config.library_path == NULL && config.mode == MODE_PLAY
+                              && access(DEFAULT_LIBRARY, R_OK) == 0;
+    if(default_library) config.library_path = DEFAULT_LIBRARY;
+    if(config.library_path != NULL){
+        if(open_rom_library(&library, config.library_path)) config.library = &library;
+        else if(!default_library) exit(EXIT_FAILURE);
+    }
+    if(config.mode == MODE_CONFORM || config.mode == MODE_AUTOTUNE || config.mode == MODE_FUZZ_INPUT){
+        const bool ok = config.mode == MODE_CONFORM ? run_conformance(&config)
+                      : config.mode == MODE_AUTOTUNE ? run_autotune(&config) : run_input_fuzzer(&config);
+        close_rom_library(&library);
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
     //Initialize SDL
     sdl_t sdl = {0};
@@ -683,11 +2379,26 @@ int main(int argc, char **argv){
 
     //Initialize chip8 machine like ./chip8 rom_name
     chip8_t chip8 = {0};
-    const char* rom_name = argv[1];
-    if(!init_chip8(&chip8, rom_name)) exit(EXIT_FAILURE); 
-
+    const char* rom_name = config.roms[0];
     //Initialize rand function with time seed 
-    srand(time(NULL));
+    chip8.rand_state = (uint32_t)time(NULL);
+    const rom_entry_t* entry = config.library ? find_rom(config.library, rom_name) : NULL;
+    if(entry != NULL){
+        init_chip8_from_library(&chip8, config.library, entry);
+        printf("%s: %u bytes%s\n", entry->name, entry->size, entry->hires ? ", hires 64x64 rom (not supported)" : "");
+        if(entry->notes[0]) printf("Notes: %s\n", entry->notes);
+        //Apply the rom's speed profile unless the clock was given
+        if(!config.ips_set) config.instructions_per_second = entry->instructions_per_second;
+        printf("Clock: %u instructions/s%s\n", config.instructions_per_second,
+               config.ips_set ? "" : entry->tuned ? " (autotuned)" : " (library default)");
+    }else if(!init_chip8(&chip8, rom_name)) exit(EXIT_FAILURE); 
+
+    //Keypad of every frame played, for --autotune --input
+    FILE* record = NULL;
+    if(config.record_path != NULL && (record = fopen(config.record_path, "wb")) == NULL){
+        SDL_Log("Could not create keypad recording %s\n", config.record_path);
+        exit(EXIT_FAILURE);
+    }
     
 
     //Get time()
@@ -699,6 +2410,13 @@ int main(int argc, char **argv){
         
         if (chip8.state == PAUSED) continue;
 
+        //Little endian key mask, the keys this frame runs with
+        if(record != NULL){
+            const uint16_t keys = keypad_mask(&chip8);
+            fputc(keys & 0xFF, record);
+            fputc(keys >> 8, record);
+        }
+
         
         //Get time before instructions
         //Since some intrcution may take longer time to proccess(like drawing the picture),
@@ -730,7 +2448,9 @@ int main(int argc, char **argv){
         update_chip8_timer(&chip8);
     }
     //Final cleanup
+    if(record != NULL) fclose(record);
     final__cleanup(sdl);
+    close_rom_library(&library);
     exit(EXIT_SUCCESS);
 }
 